@@ -3,9 +3,12 @@
 #include <time.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <string.h>
+#include "traffic_protocol.h"
 
 #define PORT 8080
 #define ROADS 4
+#define RECENT_VEHICLES 8
 
 typedef struct {
     int vehicle_id;
@@ -16,17 +19,68 @@ typedef struct {
     int rect_h;
     char targetRoad;
     int targetLane;
+    uint64_t generated_ns;
 } Vehicle;
 
-void send_data(int socket_fd, Vehicle *data) {
-    if (send(socket_fd, data, sizeof(*data), 0) < 0) {
+uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+void send_message(int socket_fd, const VehicleMessage *msg) {
+    if (send(socket_fd, msg, sizeof(*msg), 0) < 0) {
         perror("Send failed");
         exit(EXIT_FAILURE);
     }
+}
+
+void send_data(int socket_fd, Vehicle *data) {
+    VehicleMessage msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = MSG_ADD_VEHICLE;
+    msg.vehicle_id = data->vehicle_id;
+    msg.road_id = data->road_id;
+    msg.lane = data->lane;
+    msg.speed = data->speed;
+    msg.targetRoad = data->targetRoad;
+    msg.targetLane = data->targetLane;
+    msg.generated_ns = data->generated_ns;
+    send_message(socket_fd, &msg);
     printf("Data sent to client: Vehicle ID: %d on Road %c Lane %d -> Target %c Lane %d\n",
            data->vehicle_id, data->road_id, data->lane, data->targetRoad, data->targetLane);
 }
 
+void send_speed_update(int socket_fd, int vehicle_id, int speed) {
+    VehicleMessage msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = MSG_UPDATE_SPEED;
+    msg.vehicle_id = vehicle_id;
+    msg.speed = speed;
+    send_message(socket_fd, &msg);
+    printf("Update sent: Vehicle ID: %d speed %d\n", vehicle_id, speed);
+}
+
+void send_route_update(int socket_fd, int vehicle_id, char targetRoad, int targetLane) {
+    VehicleMessage msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = MSG_UPDATE_ROUTE;
+    msg.vehicle_id = vehicle_id;
+    msg.targetRoad = targetRoad;
+    msg.targetLane = targetLane;
+    send_message(socket_fd, &msg);
+    printf("Update sent: Vehicle ID: %d -> Target %c Lane %d\n", vehicle_id, targetRoad, targetLane);
+}
+
+void send_remove(int socket_fd, int vehicle_id) {
+    VehicleMessage msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = MSG_REMOVE_VEHICLE;
+    msg.vehicle_id = vehicle_id;
+    send_message(socket_fd, &msg);
+    printf("Update sent: Vehicle ID: %d removed\n", vehicle_id);
+}
+
 int create_socket() {
     int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (sock_fd < 0) {
@@ -73,6 +127,8 @@ char getRandomRoad() {
     return roads[rand() % ROADS];
 }
 
+// The simulator checks its topology against these movements; keep
+// generatorMovements in simulator.c in step with any change here.
 Vehicle generate_vehicle() {
     static int vehicle_counter = 0;
     Vehicle v;
@@ -88,6 +144,7 @@ Vehicle generate_vehicle() {
         else if (v.road_id == 'B') v.targetRoad = 'A';
         else if (v.road_id == 'C') v.targetRoad = 'D';
         else if (v.road_id == 'D') v.targetRoad = 'C';
+        v.targetLane = 2;
     } else if (v.lane == 3) {
         if (v.road_id == 'A') v.targetRoad = 'C';
         else if (v.road_id == 'B') v.targetRoad = 'D';
@@ -95,10 +152,45 @@ Vehicle generate_vehicle() {
         else if (v.road_id == 'D') v.targetRoad = 'A';
         v.targetLane = 1;
     }
+    v.generated_ns = monotonic_ns();
 
     return v;
 }
 
+char getStraightTarget(char road_id) {
+    if (road_id == 'A') return 'B';
+    if (road_id == 'B') return 'A';
+    if (road_id == 'C') return 'D';
+    return 'C';
+}
+
+// Lane 2 vehicles may also turn into lane 2 of the road on their other side.
+char getAlternateTarget(char road_id) {
+    if (road_id == 'A') return 'C';
+    if (road_id == 'B') return 'D';
+    if (road_id == 'C') return 'A';
+    return 'B';
+}
+
+// Occasionally re-speeds, reroutes or cancels one of the recently sent vehicles.
+void send_random_update(int socket_fd, Vehicle *recent, int count) {
+    if (count == 0 || rand() % 4 != 0) {
+        return;
+    }
+    Vehicle *v = &recent[rand() % count];
+    int action = rand() % 10;
+    if (action < 5) {
+        v->speed = rand() % 3 + 1;
+        send_speed_update(socket_fd, v->vehicle_id, v->speed);
+    } else if (action < 8 && v->lane == 2) {
+        v->targetRoad = (v->targetRoad == getAlternateTarget(v->road_id)) ? getStraightTarget(v->road_id)
+                                                                           : getAlternateTarget(v->road_id);
+        send_route_update(socket_fd, v->vehicle_id, v->targetRoad, v->targetLane);
+    } else if (action >= 8) {
+        send_remove(socket_fd, v->vehicle_id);
+    }
+}
+
 int main() {
     int server_fd;
     struct sockaddr_in address;
@@ -118,9 +210,14 @@ int main() {
     int new_socket = accept_connection(server_fd, &address);
     printf("Client connected! Waiting to send vehicle data...\n");
 
+    Vehicle recent[RECENT_VEHICLES];
+    int recent_count = 0;
     while (1) {
         Vehicle vehicle = generate_vehicle();
         send_data(new_socket, &vehicle);
+        recent[(vehicle.vehicle_id - 1) % RECENT_VEHICLES] = vehicle;
+        if (recent_count < RECENT_VEHICLES) recent_count++;
+        send_random_update(new_socket, recent, recent_count);
         sleep(rand() % 3 + 1); // Sleep 1-3 seconds
     }
 
@@ -0,0 +1,29 @@
+#ifndef TRAFFIC_PROTOCOL_H
+#define TRAFFIC_PROTOCOL_H
+
+#include <stdint.h>
+
+// Messages sent from the traffic generator to the simulator. Every message
+// has the same fixed size so the simulator can split the TCP stream without
+// a length prefix; fields a message type doesn't use are left zero.
+
+typedef enum {
+    MSG_ADD_VEHICLE = 1,     // new vehicle: all fields
+    MSG_UPDATE_ROUTE = 2,    // vehicle_id, targetRoad, targetLane
+    MSG_UPDATE_SPEED = 3,    // vehicle_id, speed
+    MSG_REMOVE_VEHICLE = 4,  // vehicle_id
+} MessageType;
+
+typedef struct {
+    int32_t type;
+    int32_t vehicle_id;
+    char road_id;
+    char targetRoad;
+    char reserved[2];
+    int32_t lane;
+    int32_t targetLane;
+    int32_t speed;
+    uint64_t generated_ns;  // CLOCK_MONOTONIC when generated (add only); both ends share the host clock
+} VehicleMessage;
+
+#endif
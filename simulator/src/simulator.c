@@ -9,14 +9,129 @@
 #include <stdbool.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <math.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "traffic_protocol.h"
 
 #define PORT 8080
 #define MAX_VEHICLES 100
+#define FRAME_MS 30
 const int SCREEN_WIDTH = 600;
 const int SCREEN_HEIGHT = 600;
 
-static int udGreen = 0; // initial state
-static int rlGreen = 1;
+static int activeLightGroup = 0; // light group currently green
+
+// Tunables overridden per run by the parameter sweep
+static Uint32 lightCycleMs = 8555;
+static int vehicleCapacity = MAX_VEHICLES;  // at most MAX_VEHICLES
+
+typedef struct {
+    int generated;
+    int dropped;
+    int exited;
+    double totalQueueDelayMs;
+    Uint32 maxQueueDelayMs;
+    double totalTravelMs;
+    double totalStoppedMs;
+} SimStats;
+
+static SimStats stats;
+
+#define MAX_ROADS 16
+#define MAX_LANES_PER_ROAD 8
+#define MAX_TOPOLOGY_LANES 64
+#define MAX_MOVEMENTS 256
+#define MAX_PATH_POINTS 16
+#define MAX_LIGHT_GROUPS 8
+#define MAX_SURFACES 32
+#define MAX_MARKINGS 64
+#define MAX_LAMPS 32
+
+// One precompiled movement: a polyline from the spawn point of (road, lane)
+// to the exit point of (targetRoad, targetLane), with the arc length of each
+// waypoint and of the stop line already worked out.
+typedef struct {
+    int numPoints;
+    SDL_Point points[MAX_PATH_POINTS];
+    float arcLength[MAX_PATH_POINTS];
+    float length;
+    float stopDistance;  // -1 when the movement has no stop line
+    int lightGroup;      // held at stopDistance unless this group is green
+    int fromLane;        // topology lane indices
+    int toLane;
+    int weight;          // relative spawn frequency, 0 = never spawned
+} VehiclePath;
+
+typedef struct {
+    char name;
+    int numLanes;
+    int firstLane;  // index of lane 1 in Topology.lanes
+} Road;
+
+typedef struct {
+    int road;
+    SDL_Point edge;  // where the lane meets the edge of the screen
+    int hasEdge;
+    int hasStop;
+    SDL_Point stopFrom, stopTo;
+    int lightGroup;
+} Lane;
+
+typedef struct {
+    SDL_Point corners[4];
+} Surface;
+
+typedef struct {
+    SDL_Point from, to;
+    int dash;  // 0 for a solid line
+} Marking;
+
+typedef struct {
+    SDL_Rect rect;
+    int lightGroup;
+} Lamp;
+
+// Intersection layout, loaded from a topology file and compiled into dense
+// index tables: roads by name, lanes by (road, lane) and paths by
+// (from lane, to lane), so per-vehicle work doesn't depend on its size.
+typedef struct {
+    int numRoads;
+    Road roads[MAX_ROADS];
+    signed char roadIndex[128];  // road name -> index, -1 if unknown
+    int numLanes;
+    Lane lanes[MAX_TOPOLOGY_LANES];
+    int numPaths;
+    VehiclePath paths[MAX_MOVEMENTS];
+    short pathIndex[MAX_TOPOLOGY_LANES][MAX_TOPOLOGY_LANES];  // -1 if not allowed
+    int numLightGroups;
+    char lightGroupNames[MAX_LIGHT_GROUPS][16];
+    int numSurfaces;
+    Surface surfaces[MAX_SURFACES];
+    int numMarkings;
+    Marking markings[MAX_MARKINGS];
+    int numLamps;
+    Lamp lamps[MAX_LAMPS];
+    int numSpawnRoads;
+    int spawnRoads[MAX_ROADS];  // roads with at least one weighted movement
+} Topology;
+
+static Topology topology;
+
+// Points in a vehicle's life that latency tracing stamps
+typedef enum {
+    TRACE_GENERATED,   // stamped by the generator
+    TRACE_RECEIVED,    // read off the socket
+    TRACE_ENQUEUED,    // placed in the VehicleQueue
+    TRACE_ACTIVATED,   // dequeued onto the road
+    TRACE_FIRST_STOP,  // first frame it did not move
+    TRACE_RELEASED,    // first frame it moved again after that stop
+    TRACE_EXITED,      // reached its target
+    TRACE_STAGES
+} TraceStage;
 
 typedef struct{
     SDL_Rect rect;
@@ -26,6 +141,14 @@ typedef struct{
     int speed;
     char targetRoad;
     int targetLane; 
+    const VehiclePath *path;
+    float distance;  // distance travelled along path
+    int segment;     // index of the path segment containing distance
+    Uint32 arrivalTime;
+    Uint32 activateTime;
+    int stoppedTicks;
+    int removed;  // removed by a message, freed when next reached in the queue or active list
+    uint64_t trace[TRACE_STAGES];  // CLOCK_MONOTONIC ns per stage, 0 if not reached
 } Vehicle;
 
 typedef struct {
@@ -45,23 +168,25 @@ void initQueue(VehicleQueue *q) {
 }
 
 int isQueueFull(VehicleQueue *q) {
-    return q->size >= MAX_VEHICLES;
+    return q->size >= vehicleCapacity;
 }
 
 int isQueueEmpty(VehicleQueue *q) {
     return q->size == 0;
 }
 
-void enqueue(VehicleQueue *q, Vehicle *v) {
+int enqueue(VehicleQueue *q, Vehicle *v) {
     if (isQueueFull(q)) {
         printf("Queue is full! Cannot enqueue vehicle %d\n", v->vehicle_id);
+        stats.dropped++;
         free(v);
-        return;
+        return -1;
     }
     q->rear = (q->rear + 1) % MAX_VEHICLES;
     q->vehicles[q->rear] = v;
     q->size++;
     printf("Enqueued vehicle %d on Road %c Lane %d\n", v->vehicle_id, v->road_id, v->lane);
+    return 0;
 }
 
 Vehicle* dequeue(VehicleQueue *q) {
@@ -75,6 +200,253 @@ Vehicle* dequeue(VehicleQueue *q) {
     return v;
 }
 
+/* Latency tracing: every vehicle carries CLOCK_MONOTONIC stamps for the
+ * stages below. When it exits, the time spent reaching each stage from the
+ * previous stamped one goes into a per-stage log-linear (HDR-style)
+ * histogram. Histograms are plain relaxed atomics, so the reporter thread
+ * can read them while the simulation keeps recording without any lock. */
+
+static const char *traceStageNames[TRACE_STAGES] = {
+    "generated", "received", "enqueued", "activated", "first_stop", "released", "exited"
+};
+
+#define HIST_SUB_BITS 5  // 32 sub-buckets per power of two, ~3% resolution
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+typedef struct {
+    _Atomic uint64_t counts[HIST_BUCKETS];
+    _Atomic uint64_t total;
+    _Atomic uint64_t sum;
+    _Atomic uint64_t max;
+} LatencyHistogram;
+
+// One histogram per stage reached from the stage before it, plus end to end in [0]
+static LatencyHistogram latencyHistograms[TRACE_STAGES];
+static int traceEnabled = 0;
+
+static uint64_t monotonicNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void traceStamp(Vehicle *v, TraceStage stage) {
+    if (traceEnabled && v->trace[stage] == 0) {
+        v->trace[stage] = monotonicNs();
+    }
+}
+
+static int histogramBucket(uint64_t value) {
+    if (value < (1u << HIST_SUB_BITS)) {
+        return (int)value;
+    }
+    int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) + (int)((value >> shift) & ((1u << HIST_SUB_BITS) - 1));
+}
+
+// Largest value that falls into bucket.
+static uint64_t histogramBucketValue(int bucket) {
+    if (bucket < (1 << HIST_SUB_BITS)) {
+        return (uint64_t)bucket;
+    }
+    int shift = (bucket >> HIST_SUB_BITS) - 1;
+    uint64_t lowest = ((uint64_t)(1u << HIST_SUB_BITS) + (uint64_t)(bucket & ((1 << HIST_SUB_BITS) - 1))) << shift;
+    return lowest + ((uint64_t)1 << shift) - 1;
+}
+
+static void histogramRecord(LatencyHistogram *h, uint64_t value) {
+    atomic_fetch_add_explicit(&h->counts[histogramBucket(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->total, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, value, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    while (value > max && !atomic_compare_exchange_weak_explicit(&h->max, &max, value, memory_order_relaxed,
+                                                                 memory_order_relaxed)) {
+    }
+}
+
+// Records the stage latencies of an exiting vehicle, in microseconds.
+static void traceVehicleExit(Vehicle *v) {
+    if (!traceEnabled) {
+        return;
+    }
+    traceStamp(v, TRACE_EXITED);
+    int previous = -1;
+    for (int stage = 0; stage < TRACE_STAGES; stage++) {
+        if (v->trace[stage] == 0) continue;
+        if (previous >= 0) {
+            histogramRecord(&latencyHistograms[stage], (v->trace[stage] - v->trace[previous]) / 1000);
+        }
+        previous = stage;
+    }
+    for (int stage = 0; stage < TRACE_STAGES; stage++) {
+        if (v->trace[stage] != 0) {
+            histogramRecord(&latencyHistograms[0], (v->trace[TRACE_EXITED] - v->trace[stage]) / 1000);
+            break;
+        }
+    }
+}
+
+// Reported at the top of the bucket, as HdrHistogram does, but never above
+// the largest value actually recorded.
+static uint64_t histogramPercentile(const uint64_t *counts, uint64_t total, uint64_t max, double percentile) {
+    uint64_t rank = (uint64_t)(percentile / 100.0 * (double)total + 0.5);
+    if (rank == 0) rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += counts[i];
+        if (seen >= rank) {
+            uint64_t value = histogramBucketValue(i);
+            return value < max ? value : max;
+        }
+    }
+    return 0;
+}
+
+void dumpLatencyHistograms(FILE *out) {
+    static uint64_t counts[HIST_BUCKETS];
+    fprintf(out, "# latency in us at %.3f s: stage count mean p50 p90 p99 p99.9 max\n", monotonicNs() / 1e9);
+    for (int stage = 0; stage < TRACE_STAGES; stage++) {
+        LatencyHistogram *h = &latencyHistograms[stage];
+        uint64_t total = 0;
+        for (int i = 0; i < HIST_BUCKETS; i++) {
+            counts[i] = atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+            total += counts[i];
+        }
+        uint64_t sum = atomic_load_explicit(&h->sum, memory_order_relaxed);
+        uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+        fprintf(out, "%-12s %8llu %10.0f %10llu %10llu %10llu %10llu %10llu\n",
+                stage == 0 ? "end_to_end" : traceStageNames[stage], (unsigned long long)total,
+                total ? (double)sum / (double)total : 0.0,
+                (unsigned long long)histogramPercentile(counts, total, max, 50.0),
+                (unsigned long long)histogramPercentile(counts, total, max, 90.0),
+                (unsigned long long)histogramPercentile(counts, total, max, 99.0),
+                (unsigned long long)histogramPercentile(counts, total, max, 99.9),
+                (unsigned long long)max);
+    }
+    fflush(out);
+}
+
+typedef struct {
+    FILE *out;
+    Uint32 intervalMs;
+    int stopping;
+    SDL_mutex *lock;
+    SDL_cond *wake;
+    SDL_Thread *thread;
+} TraceReporter;
+
+static int traceReporterThread(void *data) {
+    TraceReporter *reporter = (TraceReporter *)data;
+    SDL_LockMutex(reporter->lock);
+    while (!reporter->stopping) {
+        SDL_CondWaitTimeout(reporter->wake, reporter->lock, reporter->intervalMs);
+        dumpLatencyHistograms(reporter->out);
+    }
+    SDL_UnlockMutex(reporter->lock);
+    return 0;
+}
+
+int startTraceReporter(TraceReporter *reporter, const char *path, Uint32 intervalMs) {
+    memset(reporter, 0, sizeof(*reporter));
+    reporter->out = fopen(path, "a");
+    if (!reporter->out) {
+        perror("Cannot open trace output");
+        return -1;
+    }
+    reporter->intervalMs = intervalMs;
+    reporter->lock = SDL_CreateMutex();
+    reporter->wake = SDL_CreateCond();
+    reporter->thread = SDL_CreateThread(traceReporterThread, "TraceReporter", reporter);
+    if (!reporter->lock || !reporter->wake || !reporter->thread) {
+        SDL_Log("Trace reporter could not be started! SDL_Error: %s\n", SDL_GetError());
+        return -1;
+    }
+    traceEnabled = 1;
+    return 0;
+}
+
+// Writes a final dump and stops the reporter thread.
+void stopTraceReporter(TraceReporter *reporter) {
+    if (reporter->thread) {
+        SDL_LockMutex(reporter->lock);
+        reporter->stopping = 1;
+        SDL_CondSignal(reporter->wake);
+        SDL_UnlockMutex(reporter->lock);
+        SDL_WaitThread(reporter->thread, NULL);
+    }
+    if (reporter->wake) SDL_DestroyCond(reporter->wake);
+    if (reporter->lock) SDL_DestroyMutex(reporter->lock);
+    if (reporter->out) fclose(reporter->out);
+    traceEnabled = 0;
+}
+
+/* Vehicle id index: open addressing with linear probing over the vehicles
+ * that are queued or active, so update messages find their vehicle in O(1)
+ * without scanning the queue or active_vehicles. */
+
+#define VEHICLE_INDEX_SIZE 512  // power of two, well above 2 * MAX_VEHICLES
+
+typedef struct {
+    int id;  // 0 marks an empty slot; vehicle ids start at 1
+    Vehicle *vehicle;
+} VehicleIndexEntry;
+
+static VehicleIndexEntry vehicleIndex[VEHICLE_INDEX_SIZE];
+
+static unsigned int vehicleIndexSlot(int id) {
+    return ((unsigned int)id * 2654435761u) & (VEHICLE_INDEX_SIZE - 1);
+}
+
+Vehicle* findVehicle(int id) {
+    for (unsigned int i = vehicleIndexSlot(id); vehicleIndex[i].id != 0; i = (i + 1) & (VEHICLE_INDEX_SIZE - 1)) {
+        if (vehicleIndex[i].id == id) return vehicleIndex[i].vehicle;
+    }
+    return NULL;
+}
+
+static void indexVehicle(Vehicle *v) {
+    unsigned int i = vehicleIndexSlot(v->vehicle_id);
+    while (vehicleIndex[i].id != 0) {
+        i = (i + 1) & (VEHICLE_INDEX_SIZE - 1);
+    }
+    vehicleIndex[i].id = v->vehicle_id;
+    vehicleIndex[i].vehicle = v;
+}
+
+static void unindexVehicle(int id) {
+    unsigned int i = vehicleIndexSlot(id);
+    while (vehicleIndex[i].id != id) {
+        if (vehicleIndex[i].id == 0) return;
+        i = (i + 1) & (VEHICLE_INDEX_SIZE - 1);
+    }
+    // Shift later entries of the probe run back so lookups never hit a gap
+    unsigned int hole = i;
+    for (unsigned int j = (i + 1) & (VEHICLE_INDEX_SIZE - 1); vehicleIndex[j].id != 0; j = (j + 1) & (VEHICLE_INDEX_SIZE - 1)) {
+        unsigned int home = vehicleIndexSlot(vehicleIndex[j].id);
+        if (((j - home) & (VEHICLE_INDEX_SIZE - 1)) >= ((j - hole) & (VEHICLE_INDEX_SIZE - 1))) {
+            vehicleIndex[hole] = vehicleIndex[j];
+            hole = j;
+        }
+    }
+    vehicleIndex[hole].id = 0;
+    vehicleIndex[hole].vehicle = NULL;
+}
+
+// Queues a new vehicle and makes it reachable by id for later updates.
+int admitVehicle(VehicleQueue *q, Vehicle *v) {
+    if (v->vehicle_id <= 0 || findVehicle(v->vehicle_id)) {
+        printf("Vehicle id %d is invalid or already in use! Dropping it.\n", v->vehicle_id);
+        free(v);
+        return -1;
+    }
+    if (enqueue(q, v) < 0) {
+        return -1;
+    }
+    traceStamp(v, TRACE_ENQUEUED);
+    indexVehicle(v);
+    return 0;
+}
+
 int create_socket() {
     int sock = socket(AF_INET, SOCK_STREAM, 0);
     if (sock < 0) {
@@ -109,8 +481,8 @@ void drawVehicle(SDL_Renderer *renderer, Vehicle *vehicle) {
     SDL_RenderFillRect(renderer, &vehicle->rect);
 }
 
-int InitializeSDL(void) {
-    if (SDL_Init(SDL_INIT_VIDEO) < 0) {
+int InitializeSDL(Uint32 flags) {
+    if (SDL_Init(flags) < 0) {
         SDL_Log("SDL could not initialize! SDL_Error: %s\n", SDL_GetError());
         return -1;
     }
@@ -133,6 +505,172 @@ SDL_Renderer* CreateRenderer(SDL_Window *window) {
     return renderer;
 }
 
+// Software renderer drawing into a memory surface, for machines without a display.
+SDL_Renderer* CreateOffscreenRenderer(int width, int height, SDL_Surface **surface) {
+    *surface = SDL_CreateRGBSurfaceWithFormat(0, width, height, 32, SDL_PIXELFORMAT_ARGB8888);
+    if (!*surface) {
+        SDL_Log("Offscreen surface could not be created! SDL_Error: %s\n", SDL_GetError());
+        return NULL;
+    }
+    SDL_Renderer *renderer = SDL_CreateSoftwareRenderer(*surface);
+    if (!renderer) {
+        SDL_Log("Software renderer could not be created! SDL_Error: %s\n", SDL_GetError());
+        SDL_FreeSurface(*surface);
+        *surface = NULL;
+    }
+    return renderer;
+}
+
+/* Frame recording: the render loop copies sampled frames into a bounded ring
+ * of preallocated buffers and an encoder thread writes them to disk. When the
+ * ring is full the frame is dropped rather than stalling the simulation. */
+
+#define RECORD_QUEUE_SIZE 8
+
+typedef enum { RECORD_BMP, RECORD_RAW } RecordFormat;
+
+typedef struct {
+    Uint8 *pixels[RECORD_QUEUE_SIZE];
+    int frameNumbers[RECORD_QUEUE_SIZE];
+    int head;
+    int count;
+    int stopping;
+    int width;
+    int height;
+    int pitch;
+    RecordFormat format;
+    const char *directory;
+    int written;
+    int dropped;
+    SDL_mutex *lock;
+    SDL_cond *ready;
+    SDL_Thread *thread;
+} FrameRecorder;
+
+static void writeFrame(const FrameRecorder *rec, const Uint8 *pixels, int frameNumber) {
+    char path[512];
+    if (rec->format == RECORD_BMP) {
+        snprintf(path, sizeof(path), "%s/frame_%06d.bmp", rec->directory, frameNumber);
+        SDL_Surface *surface = SDL_CreateRGBSurfaceWithFormatFrom((void *)pixels, rec->width, rec->height, 32,
+                                                                  rec->pitch, SDL_PIXELFORMAT_ARGB8888);
+        if (!surface || SDL_SaveBMP(surface, path) < 0) {
+            SDL_Log("Could not write %s! SDL_Error: %s\n", path, SDL_GetError());
+        }
+        SDL_FreeSurface(surface);
+        return;
+    }
+
+    // Raw frames are binary PPM (8-bit RGB behind a one-line header)
+    snprintf(path, sizeof(path), "%s/frame_%06d.ppm", rec->directory, frameNumber);
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        perror("Could not write frame");
+        return;
+    }
+    fprintf(file, "P6\n%d %d\n255\n", rec->width, rec->height);
+    Uint8 *row = (Uint8 *)malloc((size_t)rec->width * 3);
+    for (int y = 0; row && y < rec->height; y++) {
+        const Uint32 *src = (const Uint32 *)(pixels + (size_t)y * rec->pitch);
+        for (int x = 0; x < rec->width; x++) {
+            row[x * 3] = (Uint8)(src[x] >> 16);
+            row[x * 3 + 1] = (Uint8)(src[x] >> 8);
+            row[x * 3 + 2] = (Uint8)src[x];
+        }
+        fwrite(row, 3, (size_t)rec->width, file);
+    }
+    free(row);
+    fclose(file);
+}
+
+static int recorderThread(void *data) {
+    FrameRecorder *rec = (FrameRecorder *)data;
+    SDL_LockMutex(rec->lock);
+    for (;;) {
+        while (rec->count == 0 && !rec->stopping) {
+            SDL_CondWait(rec->ready, rec->lock);
+        }
+        if (rec->count == 0) {
+            break;
+        }
+        int slot = rec->head;
+        SDL_UnlockMutex(rec->lock);
+
+        // The producer never touches the head slot while it is still counted
+        writeFrame(rec, rec->pixels[slot], rec->frameNumbers[slot]);
+
+        SDL_LockMutex(rec->lock);
+        rec->head = (rec->head + 1) % RECORD_QUEUE_SIZE;
+        rec->count--;
+        rec->written++;
+    }
+    SDL_UnlockMutex(rec->lock);
+    return 0;
+}
+
+int startRecorder(FrameRecorder *rec, const char *directory, RecordFormat format, int width, int height) {
+    memset(rec, 0, sizeof(*rec));
+    rec->directory = directory;
+    rec->format = format;
+    rec->width = width;
+    rec->height = height;
+    rec->pitch = width * 4;
+    for (int i = 0; i < RECORD_QUEUE_SIZE; i++) {
+        rec->pixels[i] = (Uint8 *)malloc((size_t)rec->pitch * height);
+        if (!rec->pixels[i]) {
+            perror("malloc failed");
+            return -1;
+        }
+    }
+    rec->lock = SDL_CreateMutex();
+    rec->ready = SDL_CreateCond();
+    rec->thread = SDL_CreateThread(recorderThread, "FrameRecorder", rec);
+    if (!rec->lock || !rec->ready || !rec->thread) {
+        SDL_Log("Frame recorder could not be started! SDL_Error: %s\n", SDL_GetError());
+        return -1;
+    }
+    return 0;
+}
+
+// Copies the current frame into the ring; never waits for the encoder.
+void captureFrame(FrameRecorder *rec, SDL_Renderer *renderer, int frameNumber) {
+    SDL_LockMutex(rec->lock);
+    int full = rec->count == RECORD_QUEUE_SIZE;
+    int slot = (rec->head + rec->count) % RECORD_QUEUE_SIZE;
+    if (full) rec->dropped++;
+    SDL_UnlockMutex(rec->lock);
+    if (full) {
+        return;
+    }
+
+    // Bounded to the ring's size; a HiDPI output is larger than the window
+    SDL_Rect area = {0, 0, rec->width, rec->height};
+    if (SDL_RenderReadPixels(renderer, &area, SDL_PIXELFORMAT_ARGB8888, rec->pixels[slot], rec->pitch) < 0) {
+        SDL_Log("Could not read frame %d! SDL_Error: %s\n", frameNumber, SDL_GetError());
+        return;
+    }
+    rec->frameNumbers[slot] = frameNumber;
+
+    SDL_LockMutex(rec->lock);
+    rec->count++;
+    SDL_CondSignal(rec->ready);
+    SDL_UnlockMutex(rec->lock);
+}
+
+// Drains the frames still queued, then stops the encoder thread.
+void stopRecorder(FrameRecorder *rec) {
+    if (rec->thread) {
+        SDL_LockMutex(rec->lock);
+        rec->stopping = 1;
+        SDL_CondSignal(rec->ready);
+        SDL_UnlockMutex(rec->lock);
+        SDL_WaitThread(rec->thread, NULL);
+        printf("Recorded %d frames to %s (%d dropped)\n", rec->written, rec->directory, rec->dropped);
+    }
+    if (rec->ready) SDL_DestroyCond(rec->ready);
+    if (rec->lock) SDL_DestroyMutex(rec->lock);
+    for (int i = 0; i < RECORD_QUEUE_SIZE; i++) free(rec->pixels[i]);
+}
+
 void DrawDashedLine(SDL_Renderer *renderer, int x1, int y1, int x2, int y2, int dashLength) {
     int dx = x2 - x1;
     int dy = y2 - y1;
@@ -164,64 +702,25 @@ void DrawDashedLine(SDL_Renderer *renderer, int x1, int y1, int x2, int y2, int
 }
 
 void DrawLaneMarking(SDL_Renderer *renderer) {
-    SDL_Color laneMarking = {247, 233, 23, 255}; // Yellow (unchanged for dashed lines)
-    // Change: Use yellow for all lines, including middle dividers (previously red)
-    SDL_Color laneMarkingYellow = {247, 233, 23, 255}; // Was laneMarkingRed
-
-    SDL_SetRenderDrawColor(renderer, laneMarking.r, laneMarking.g, laneMarking.b, laneMarking.a);
-    DrawDashedLine(renderer, 0, 250, 150, 250, 10);
-    DrawDashedLine(renderer, 0, 350, 150, 350, 10);
-    DrawDashedLine(renderer, 450, 250, 600, 250, 10);
-    DrawDashedLine(renderer, 450, 350, 600, 350, 10);
-
-    // Change: Middle dividers now yellow instead of red
-    SDL_SetRenderDrawColor(renderer, laneMarkingYellow.r, laneMarkingYellow.g, laneMarkingYellow.b, laneMarkingYellow.a);
-    DrawDashedLine(renderer, 600, 300, 450, 300, 0);
-    DrawDashedLine(renderer, 0, 300, 150, 300, 0);
+    SDL_Color laneMarking = {247, 233, 23, 255}; // Yellow
 
     SDL_SetRenderDrawColor(renderer, laneMarking.r, laneMarking.g, laneMarking.b, laneMarking.a);
-    DrawDashedLine(renderer, 250, 0, 250, 150, 10);
-    DrawDashedLine(renderer, 350, 0, 350, 150, 10);
-    DrawDashedLine(renderer, 250, 450, 250, 600, 10);
-    DrawDashedLine(renderer, 350, 450, 350, 600, 10);
-
-    SDL_SetRenderDrawColor(renderer, laneMarkingYellow.r, laneMarkingYellow.g, laneMarkingYellow.b, laneMarkingYellow.a);
-    DrawDashedLine(renderer, 300, 0, 300, 150, 0);
-    DrawDashedLine(renderer, 300, 600, 300, 450, 0);
-}
-
-void DrawTrafficLight(SDL_Renderer *renderer, int XPos, int YPos, int isGreen, char *orientation) {
-
-    const int width = 30;
-    const int height = 90;
-
-    if (isGreen) {
-        SDL_SetRenderDrawColor(renderer, 0, 255, 0, 255);
-    } else {
-        SDL_SetRenderDrawColor(renderer, 255, 0, 0, 255);
+    for (int i = 0; i < topology.numMarkings; i++) {
+        const Marking *m = &topology.markings[i];
+        DrawDashedLine(renderer, m->from.x, m->from.y, m->to.x, m->to.y, m->dash);
     }
-
-    SDL_Rect trafficLightRect;
-
-    if (strcmp(orientation, "vertical") == 0) {
-        trafficLightRect = (SDL_Rect){XPos, YPos, width, height}; // Horizontal orientation
-    } else if (strcmp(orientation, "horizontal") == 0) {
-        trafficLightRect = (SDL_Rect){XPos, YPos, height, width}; // Vertical orientation
-    } else {
-        printf("Invalid orientation: %s\n", orientation);
-        return;
-    }
-
-    SDL_RenderFillRect(renderer, &trafficLightRect);
 }
 
-void TrafficLightState(SDL_Renderer *renderer, int udGreen, int rlGreen) {
-    // Vertical lights control North-South traffic
-    DrawTrafficLight(renderer, 175, 255, udGreen, "vertical"); // North-South left lane
-    DrawTrafficLight(renderer, 395, 255, udGreen, "vertical"); // North-South right lane
-    // Horizontal lights control East-West traffic
-    DrawTrafficLight(renderer, 255, 175, rlGreen, "horizontal"); // East-West upper lane
-    DrawTrafficLight(renderer, 255, 395, rlGreen, "horizontal"); // East-West lower lane
+void TrafficLightState(SDL_Renderer *renderer) {
+    for (int i = 0; i < topology.numLamps; i++) {
+        const Lamp *lamp = &topology.lamps[i];
+        if (lamp->lightGroup == activeLightGroup) {
+            SDL_SetRenderDrawColor(renderer, 0, 255, 0, 255);
+        } else {
+            SDL_SetRenderDrawColor(renderer, 255, 0, 0, 255);
+        }
+        SDL_RenderFillRect(renderer, &lamp->rect);
+    }
 }
 
 void DrawBackground(SDL_Renderer *renderer) {
@@ -229,12 +728,18 @@ void DrawBackground(SDL_Renderer *renderer) {
     SDL_RenderClear(renderer);
 
     // Change: Road color from dark grey (50, 50, 50) to lighter grey (150, 150, 150)
-    SDL_SetRenderDrawColor(renderer, 150, 150, 150, 255);
-
-    SDL_Rect horizontalRoad = {0, 150, 600, 300};
-    SDL_RenderFillRect(renderer, &horizontalRoad);
-    SDL_Rect verticalRoad = {150, 0, 300, 600};
-    SDL_RenderFillRect(renderer, &verticalRoad);
+    SDL_Color road = {150, 150, 150, 255};
+    static const int quadTriangles[6] = {0, 1, 2, 0, 2, 3};
+    for (int i = 0; i < topology.numSurfaces; i++) {
+        SDL_Vertex vertices[4];
+        for (int c = 0; c < 4; c++) {
+            vertices[c].position.x = (float)topology.surfaces[i].corners[c].x;
+            vertices[c].position.y = (float)topology.surfaces[i].corners[c].y;
+            vertices[c].color = road;
+            vertices[c].tex_coord.x = vertices[c].tex_coord.y = 0.0f;
+        }
+        SDL_RenderGeometry(renderer, NULL, vertices, 4, quadTriangles, 6);
+    }
     DrawLaneMarking(renderer);
 }
 
@@ -264,218 +769,1098 @@ void DrawBackground(SDL_Renderer *renderer) {
     static SDL_Window *window = NULL;
     static SDL_Renderer *renderer = NULL;
 
-    typedef struct{ 
-        int x_start, x_end;
-        int y_start, y_end;
-    } LanePosition;
-
-LanePosition lanePositions[4][3] = {
-    // A road lanes (North to South) (A1, A2, A3)
-    // A2 is split into two - leftmost (outgoing), rightmost (incoming)
-    { {150, 250, -30, -30}, {270, 300, -30, -30}, {350, 450, -30, -30} },
+// The original four-way intersection, used when no --topology file is given.
+static const char defaultTopology[] =
+    "# Four-way intersection, roads A (north) B (south) C (east) D (west)\n"
+    "road A 3\n"
+    "road B 3\n"
+    "road C 3\n"
+    "road D 3\n"
+    "lane A 1 200 -30\n"
+    "lane A 2 270 -30\n"
+    "lane A 3 400 -30\n"
+    "lane B 1 400 610\n"
+    "lane B 2 330 610\n"
+    "lane B 3 200 610\n"
+    "lane C 1 610 200\n"
+    "lane C 2 610 270\n"
+    "lane C 3 610 400\n"
+    "lane D 1 -30 400\n"
+    "lane D 2 -30 330\n"
+    "lane D 3 -30 200\n"
+    "light ns\n"
+    "light ew\n"
+    "# Only lane 2 waits at the stop line; lane 3 turns freely\n"
+    "stop A 2 ns 150 130 450 130\n"
+    "stop B 2 ns 150 450 450 450\n"
+    "stop C 2 ew 450 150 450 450\n"
+    "stop D 2 ew 130 150 130 450\n"
+    "# Lane 2 goes straight; weight 0 movements are allowed but not generated\n"
+    "move A 2 B 2 1 330 -30\n"
+    "move A 2 C 2 0 270 270\n"
+    "move C 2 A 2 0 270 270\n"
+    "move C 2 D 2 1 -30 270\n"
+    "move B 2 A 2 1 270 610\n"
+    "move B 2 D 2 0 330 330\n"
+    "move D 2 C 2 1 610 330\n"
+    "move D 2 B 2 0 330 330\n"
+    "# Lane 3 turns into lane 1 of the next road\n"
+    "move D 3 A 1 1 200 200\n"
+    "move A 3 C 1 1 400 200\n"
+    "move C 3 B 1 1 400 400\n"
+    "move B 3 D 1 1 200 400\n"
+    "surface 0 150 600 150 600 450 0 450\n"
+    "surface 150 0 450 0 450 600 150 600\n"
+    "marking 0 250 150 250 10\n"
+    "marking 0 350 150 350 10\n"
+    "marking 450 250 600 250 10\n"
+    "marking 450 350 600 350 10\n"
+    "marking 600 300 450 300 0\n"
+    "marking 0 300 150 300 0\n"
+    "marking 250 0 250 150 10\n"
+    "marking 350 0 350 150 10\n"
+    "marking 250 450 250 600 10\n"
+    "marking 350 450 350 600 10\n"
+    "marking 300 0 300 150 0\n"
+    "marking 300 600 300 450 0\n"
+    "lamp ew 175 255 30 90\n"
+    "lamp ew 395 255 30 90\n"
+    "lamp ns 255 175 90 30\n"
+    "lamp ns 255 395 90 30\n";
+
+static int topologyError(const char *source, int line, const char *message, const char *detail) {
+    fprintf(stderr, "%s:%d: %s%s%s\n", source, line, message, detail ? ": " : "", detail ? detail : "");
+    return -1;
+}
 
-    // B road lanes (South to North) (B1, B2, B3)
-    // B2 is split into two - leftmost (incoming), rightmost (outgoing)
-    { {350, 450, 630, 630}, {300, 330, 630, 630}, {150, 250, 630, 630} },
+static int findRoad(const char *name) {
+    if (strlen(name) != 1 || (unsigned char)name[0] >= 128) return -1;
+    return topology.roadIndex[(unsigned char)name[0]];
+}
 
-    // C road lanes (East to West) (C1, C2, C3)
-    // C2 is split into two - uppermost (outgoing), lowermost (incoming)
-    { {630, 630, 150, 250}, {630, 630, 270, 300}, {630, 630, 350, 450} },
+// Topology lane index of (road name, 1-based lane), or -1.
+static int findLane(const char *road, int lane) {
+    int r = findRoad(road);
+    if (r < 0 || lane < 1 || lane > topology.roads[r].numLanes) return -1;
+    return topology.roads[r].firstLane + lane - 1;
+}
 
-    // D road lanes (West to East) (D1, D2, D3)
-    // D2 is split into two - uppermost (incoming), lowermost (outgoing)
-    { {-30, -30, 350, 450}, {-30, -30, 300, 330}, {-30, -30, 150, 250} }
-};
+static int findLightGroup(const char *name) {
+    for (int i = 0; i < topology.numLightGroups; i++) {
+        if (strcmp(topology.lightGroupNames[i], name) == 0) return i;
+    }
+    return -1;
+}
 
-void getLaneCenter(char road, int lane, int *x, int *y) {
-    int roadIndex = road - 'A';  // Convert 'A'-'D' to index 0-3
-    int laneIndex = lane - 1;    // Convert 1-3 to index 0-2
+static void appendPathPoint(VehiclePath *path, int x, int y) {
+    if (path->numPoints > 0) {
+        SDL_Point *last = &path->points[path->numPoints - 1];
+        if (last->x == x && last->y == y) {
+            return;
+        }
+        float dx = (float)(x - last->x);
+        float dy = (float)(y - last->y);
+        path->arcLength[path->numPoints] = path->arcLength[path->numPoints - 1] + sqrtf(dx * dx + dy * dy);
+    } else {
+        path->arcLength[0] = 0.0f;
+    }
+    path->points[path->numPoints++] = (SDL_Point){x, y};
+}
 
-    int middleLaneOffset = 0;
-    if (lane == 2) {
-        if (road == 'A') {
-            middleLaneOffset = -15; // Move left for outgoing
-        } else if (road == 'B') {
-            middleLaneOffset = 15;  // Move right for incoming
-        } else if (road == 'D') {
-            middleLaneOffset = 15;  // Move down for outgoing
-        } else if (road == 'C') {
-            middleLaneOffset = -15; // Move up for incoming
+// Arc length at which the path first crosses the segment from-to, or -1.
+static float pathDistanceAt(const VehiclePath *path, SDL_Point from, SDL_Point to) {
+    float ex = (float)(to.x - from.x), ey = (float)(to.y - from.y);
+    for (int i = 0; i + 1 < path->numPoints; i++) {
+        const SDL_Point *p0 = &path->points[i];
+        const SDL_Point *p1 = &path->points[i + 1];
+        float dx = (float)(p1->x - p0->x), dy = (float)(p1->y - p0->y);
+        float denom = dx * ey - dy * ex;
+        if (denom == 0.0f) {
+            continue;  // parallel to the stop line
+        }
+        float wx = (float)(from.x - p0->x), wy = (float)(from.y - p0->y);
+        float t = (wx * ey - wy * ex) / denom;  // along the path segment
+        float u = (wx * dy - wy * dx) / denom;  // along the stop line
+        if (t >= 0.0f && t <= 1.0f && u >= 0.0f && u <= 1.0f) {
+            return path->arcLength[i] + t * (path->arcLength[i + 1] - path->arcLength[i]);
         }
     }
+    return -1.0f;
+}
+
+static int parseTopologyLine(char *text, const char *source, int line) {
+    char *argv[24];
+    int argc = 0;
+    for (char *tok = strtok(text, " \t\r\n"); tok; tok = strtok(NULL, " \t\r\n")) {
+        if (argc == 24) return topologyError(source, line, "too many fields", NULL);
+        argv[argc++] = tok;
+    }
+    if (argc == 0 || argv[0][0] == '#') {
+        return 0;
+    }
+    int n[20];
+    const char *kind = argv[0];
 
-    if (road == 'A' || road == 'B') {
-        *x = ((lanePositions[roadIndex][laneIndex].x_start + lanePositions[roadIndex][laneIndex].x_end) / 2) + middleLaneOffset;
-        *y = (road == 'A') ? -30 : SCREEN_HEIGHT + 10;
+    if (strcmp(kind, "road") == 0) {
+        if (argc != 3 || strlen(argv[1]) != 1 || (unsigned char)argv[1][0] >= 128) {
+            return topologyError(source, line, "expected: road <name> <lanes>", NULL);
+        }
+        int lanes = atoi(argv[2]);
+        if (findRoad(argv[1]) >= 0) return topologyError(source, line, "duplicate road", argv[1]);
+        if (topology.numRoads == MAX_ROADS) return topologyError(source, line, "too many roads", NULL);
+        if (lanes < 1 || lanes > MAX_LANES_PER_ROAD || topology.numLanes + lanes > MAX_TOPOLOGY_LANES) {
+            return topologyError(source, line, "bad lane count", argv[2]);
+        }
+        Road *road = &topology.roads[topology.numRoads];
+        road->name = argv[1][0];
+        road->numLanes = lanes;
+        road->firstLane = topology.numLanes;
+        for (int i = 0; i < lanes; i++) {
+            topology.lanes[topology.numLanes + i].road = topology.numRoads;
+            topology.lanes[topology.numLanes + i].lightGroup = -1;
+        }
+        topology.roadIndex[(unsigned char)road->name] = (signed char)topology.numRoads++;
+        topology.numLanes += lanes;
+    } else if (strcmp(kind, "lane") == 0) {
+        if (argc != 5) return topologyError(source, line, "expected: lane <road> <lane> <x> <y>", NULL);
+        int lane = findLane(argv[1], atoi(argv[2]));
+        if (lane < 0) return topologyError(source, line, "unknown lane", argv[2]);
+        topology.lanes[lane].edge = (SDL_Point){atoi(argv[3]), atoi(argv[4])};
+        topology.lanes[lane].hasEdge = 1;
+    } else if (strcmp(kind, "light") == 0) {
+        if (argc != 2 || strlen(argv[1]) >= sizeof(topology.lightGroupNames[0])) {
+            return topologyError(source, line, "expected: light <group>", NULL);
+        }
+        if (findLightGroup(argv[1]) >= 0) return topologyError(source, line, "duplicate light group", argv[1]);
+        if (topology.numLightGroups == MAX_LIGHT_GROUPS) return topologyError(source, line, "too many light groups", NULL);
+        strcpy(topology.lightGroupNames[topology.numLightGroups++], argv[1]);
+    } else if (strcmp(kind, "stop") == 0) {
+        if (argc != 8) return topologyError(source, line, "expected: stop <road> <lane> <group> <x1> <y1> <x2> <y2>", NULL);
+        int lane = findLane(argv[1], atoi(argv[2]));
+        int group = findLightGroup(argv[3]);
+        if (lane < 0) return topologyError(source, line, "unknown lane", argv[2]);
+        if (group < 0) return topologyError(source, line, "unknown light group", argv[3]);
+        for (int i = 0; i < 4; i++) n[i] = atoi(argv[4 + i]);
+        topology.lanes[lane].hasStop = 1;
+        topology.lanes[lane].stopFrom = (SDL_Point){n[0], n[1]};
+        topology.lanes[lane].stopTo = (SDL_Point){n[2], n[3]};
+        topology.lanes[lane].lightGroup = group;
+    } else if (strcmp(kind, "move") == 0) {
+        if (argc < 6 || (argc - 6) % 2 != 0 || (argc - 6) / 2 > MAX_PATH_POINTS - 2) {
+            return topologyError(source, line, "expected: move <road> <lane> <targetRoad> <targetLane> <weight> [<x> <y>]...", NULL);
+        }
+        int from = findLane(argv[1], atoi(argv[2]));
+        int to = findLane(argv[3], atoi(argv[4]));
+        if (from < 0 || to < 0) return topologyError(source, line, "unknown lane", NULL);
+        if (topology.numPaths == MAX_MOVEMENTS) return topologyError(source, line, "too many movements", NULL);
+        if (topology.pathIndex[from][to] >= 0) return topologyError(source, line, "duplicate movement", NULL);
+        VehiclePath *path = &topology.paths[topology.numPaths];
+        memset(path, 0, sizeof(*path));
+        path->fromLane = from;
+        path->toLane = to;
+        path->weight = atoi(argv[5]);
+        if (path->weight < 0) return topologyError(source, line, "negative weight", argv[5]);
+        // Waypoints for now; compileTopology adds the lane ends once all lanes are known
+        for (int i = 6; i + 1 < argc; i += 2) {
+            path->points[path->numPoints++] = (SDL_Point){atoi(argv[i]), atoi(argv[i + 1])};
+        }
+        topology.pathIndex[from][to] = (short)topology.numPaths++;
+    } else if (strcmp(kind, "surface") == 0) {
+        if (argc != 9) return topologyError(source, line, "expected: surface <x1> <y1> <x2> <y2> <x3> <y3> <x4> <y4>", NULL);
+        if (topology.numSurfaces == MAX_SURFACES) return topologyError(source, line, "too many surfaces", NULL);
+        Surface *surface = &topology.surfaces[topology.numSurfaces++];
+        for (int i = 0; i < 4; i++) {
+            surface->corners[i] = (SDL_Point){atoi(argv[1 + 2 * i]), atoi(argv[2 + 2 * i])};
+        }
+    } else if (strcmp(kind, "marking") == 0) {
+        if (argc != 6) return topologyError(source, line, "expected: marking <x1> <y1> <x2> <y2> <dash>", NULL);
+        if (topology.numMarkings == MAX_MARKINGS) return topologyError(source, line, "too many markings", NULL);
+        for (int i = 0; i < 5; i++) n[i] = atoi(argv[1 + i]);
+        topology.markings[topology.numMarkings++] = (Marking){{n[0], n[1]}, {n[2], n[3]}, n[4]};
+    } else if (strcmp(kind, "lamp") == 0) {
+        if (argc != 6) return topologyError(source, line, "expected: lamp <group> <x> <y> <w> <h>", NULL);
+        int group = findLightGroup(argv[1]);
+        if (group < 0) return topologyError(source, line, "unknown light group", argv[1]);
+        if (topology.numLamps == MAX_LAMPS) return topologyError(source, line, "too many lamps", NULL);
+        for (int i = 0; i < 4; i++) n[i] = atoi(argv[2 + i]);
+        topology.lamps[topology.numLamps++] = (Lamp){{n[0], n[1], n[2], n[3]}, group};
     } else {
-        *x = (road == 'C') ? SCREEN_WIDTH + 10 : -30;
-        *y = ((lanePositions[roadIndex][laneIndex].y_start + lanePositions[roadIndex][laneIndex].y_end) / 2) + middleLaneOffset;
+        return topologyError(source, line, "unknown entry", kind);
+    }
+    return 0;
+}
+
+// Turns every movement into a polyline from its entry lane to its exit lane,
+// through the listed waypoints, and places the stop line on it.
+static int compileTopology(const char *source) {
+    topology.numSpawnRoads = 0;
+    for (int l = 0; l < topology.numLanes; l++) {
+        const Road *road = &topology.roads[topology.lanes[l].road];
+        if (!topology.lanes[l].hasEdge) {
+            fprintf(stderr, "%s: lane %c%d has no lane entry\n", source, road->name, l - road->firstLane + 1);
+            return -1;
+        }
+    }
+    for (int p = 0; p < topology.numPaths; p++) {
+        VehiclePath *path = &topology.paths[p];
+        const Lane *from = &topology.lanes[path->fromLane];
+        const Lane *to = &topology.lanes[path->toLane];
+
+        SDL_Point waypoints[MAX_PATH_POINTS];
+        int numWaypoints = path->numPoints;
+        memcpy(waypoints, path->points, sizeof(SDL_Point) * (size_t)numWaypoints);
+        path->numPoints = 0;
+        appendPathPoint(path, from->edge.x, from->edge.y);
+        for (int i = 0; i < numWaypoints; i++) {
+            appendPathPoint(path, waypoints[i].x, waypoints[i].y);
+        }
+        appendPathPoint(path, to->edge.x, to->edge.y);
+        path->length = path->arcLength[path->numPoints - 1];
+
+        path->stopDistance = -1.0f;
+        path->lightGroup = -1;
+        if (from->hasStop) {
+            path->stopDistance = pathDistanceAt(path, from->stopFrom, from->stopTo);
+            if (path->stopDistance >= 0) {
+                path->lightGroup = from->lightGroup;
+            }
+        }
     }
 
-    printf("Road: %c, Lane: %d, X: %d, Y: %d, Offset: %d\n", road, lane, *x, *y, middleLaneOffset);
+    for (int r = 0; r < topology.numRoads; r++) {
+        for (int p = 0; p < topology.numPaths; p++) {
+            if (topology.paths[p].weight > 0 && topology.lanes[topology.paths[p].fromLane].road == r) {
+                topology.spawnRoads[topology.numSpawnRoads++] = r;
+                break;
+            }
+        }
+    }
+    return 0;
 }
 
-void moveVehicle(Vehicle *vehicle) {
-    int targetX, targetY;
-    getLaneCenter(vehicle->targetRoad, vehicle->targetLane, &targetX, &targetY);
-
-    if (vehicle->targetLane == 1) {
-        if (!((vehicle->road_id == 'D' && vehicle->lane == 3 && vehicle->targetRoad == 'A') ||
-              (vehicle->road_id == 'A' && vehicle->lane == 3 && vehicle->targetRoad == 'C') ||
-              (vehicle->road_id == 'C' && vehicle->lane == 3 && vehicle->targetRoad == 'B') ||
-              (vehicle->road_id == 'B' && vehicle->lane == 3 && vehicle->targetRoad == 'D'))) {
-            printf("Vehicle %d is not allowed to move to Lane 1! Stopping movement.\n", vehicle->vehicle_id);
-            return;
+static int parseTopology(const char *text, const char *source) {
+    memset(&topology, 0, sizeof(topology));
+    memset(topology.roadIndex, -1, sizeof(topology.roadIndex));
+    memset(topology.pathIndex, -1, sizeof(topology.pathIndex));
+
+    char lineBuffer[512];
+    int line = 0;
+    while (*text) {
+        size_t len = strcspn(text, "\n");
+        line++;
+        if (len >= sizeof(lineBuffer)) {
+            return topologyError(source, line, "line too long", NULL);
+        }
+        memcpy(lineBuffer, text, len);
+        lineBuffer[len] = '\0';
+        if (parseTopologyLine(lineBuffer, source, line) < 0) {
+            return -1;
         }
+        text += len;
+        if (*text == '\n') text++;
     }
 
-    if (vehicle->targetLane == 2) {
-        if (!((vehicle->road_id == 'A' && vehicle->lane == 2 && vehicle->targetRoad == 'B') ||
-              (vehicle->road_id == 'A' && vehicle->lane == 2 && vehicle->targetRoad == 'C') ||
-              (vehicle->road_id == 'C' && vehicle->lane == 2 && vehicle->targetRoad == 'A') ||
-              (vehicle->road_id == 'C' && vehicle->lane == 2 && vehicle->targetRoad == 'D') ||
-              (vehicle->road_id == 'B' && vehicle->lane == 2 && vehicle->targetRoad == 'A') ||
-              (vehicle->road_id == 'B' && vehicle->lane == 2 && vehicle->targetRoad == 'D') ||
-              (vehicle->road_id == 'D' && vehicle->lane == 2 && vehicle->targetRoad == 'C') ||
-              (vehicle->road_id == 'D' && vehicle->lane == 2 && vehicle->targetRoad == 'B'))) {
-            printf("Vehicle %d is not allowed to move to Lane 2! Stopping movement.\n", vehicle->vehicle_id);
-            return;
+    if (topology.numRoads == 0 || topology.numPaths == 0) {
+        return topologyError(source, line, "topology needs at least one road and one movement", NULL);
+    }
+    if (topology.numLightGroups == 0) {
+        strcpy(topology.lightGroupNames[topology.numLightGroups++], "all");
+    }
+    if (compileTopology(source) < 0) {
+        return -1;
+    }
+    fprintf(stderr, "Loaded topology %s: %d roads, %d lanes, %d movements, %d light groups\n", source,
+           topology.numRoads, topology.numLanes, topology.numPaths, topology.numLightGroups);
+    return 0;
+}
+
+// Loads the intersection layout from path, or the built-in four-way one when path is NULL.
+int loadTopology(const char *path) {
+    if (!path) {
+        return parseTopology(defaultTopology, "built-in");
+    }
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        perror("Cannot open topology");
+        return -1;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char *text = (char *)malloc((size_t)size + 1);
+    if (!text || fread(text, 1, (size_t)size, file) != (size_t)size) {
+        perror("Cannot read topology");
+        fclose(file);
+        free(text);
+        return -1;
+    }
+    text[size] = '\0';
+    fclose(file);
+    int result = parseTopology(text, path);
+    free(text);
+    return result;
+}
+
+const VehiclePath* findMovementPath(char road, int lane, char targetRoad, int targetLane) {
+    char roadName[2] = {road, '\0'};
+    char targetName[2] = {targetRoad, '\0'};
+    int from = findLane(roadName, lane);
+    int to = findLane(targetName, targetLane);
+    if (from < 0 || to < 0 || topology.pathIndex[from][to] < 0) {
+        return NULL;
+    }
+    return &topology.paths[topology.pathIndex[from][to]];
+}
+
+// Every movement the traffic generator sends, reroutes included (see
+// generate_vehicle and getAlternateTarget in traffic_generator.c).
+static const struct {
+    char road;
+    int lane;
+    char targetRoad;
+    int targetLane;
+} generatorMovements[] = {
+    {'A', 2, 'B', 2}, {'B', 2, 'A', 2}, {'C', 2, 'D', 2}, {'D', 2, 'C', 2},
+    {'A', 2, 'C', 2}, {'B', 2, 'D', 2}, {'C', 2, 'A', 2}, {'D', 2, 'B', 2},
+    {'A', 3, 'C', 1}, {'B', 3, 'D', 1}, {'C', 3, 'B', 1}, {'D', 3, 'A', 1},
+};
+
+// Fails when the loaded topology lacks a movement the generator can send,
+// since every such vehicle would be dropped.
+int checkGeneratorMovements(const char *source) {
+    int missing = 0;
+    for (size_t i = 0; i < sizeof(generatorMovements) / sizeof(generatorMovements[0]); i++) {
+        if (!findMovementPath(generatorMovements[i].road, generatorMovements[i].lane,
+                              generatorMovements[i].targetRoad, generatorMovements[i].targetLane)) {
+            fprintf(stderr, "%s: no movement %c%d -> %c%d, which the traffic generator sends\n", source,
+                    generatorMovements[i].road, generatorMovements[i].lane,
+                    generatorMovements[i].targetRoad, generatorMovements[i].targetLane);
+            missing++;
         }
     }
-   /*Vehicle Stopping Logic */
-  int shouldStop = 0;  
-  int stopX = vehicle->rect.x;  
-  int stopY = vehicle->rect.y;  
-
-  //For lane 2 only  
-
-  //For lane 2 only 
-  if (vehicle->lane == 2) {
-    if (vehicle->road_id == 'A' && udGreen) {
-      stopY = 150 - 20;
-      if (vehicle->rect.y == stopY) {
-        shouldStop = 1;
-      } else {
-        shouldStop =0;
-      }
-    }
-
-    if (vehicle->road_id == 'B' && udGreen) {
-      stopY = 450;
-      if (vehicle->rect.y == stopY) {
-        shouldStop = 1;
-      }else{
-        shouldStop =0; 
-      }
-    }
-
-    if (vehicle->road_id == 'D' && rlGreen) {
-      stopX = 150 - 20;
-      if (vehicle->rect.x == stopX) {
-        shouldStop = 1;
-      }else{
-        shouldStop=0;
-      }
-    }
-
-    if (vehicle->road_id == 'C' && rlGreen) {
-      stopX = 450;
-      if (vehicle->rect.x == stopX) {
-        shouldStop = 1;
-      }else{
-        shouldStop = 0;
-      }
-    }
-  }
-
-    if (shouldStop) {
-        vehicle->rect.x = stopX;
-        vehicle->rect.y = stopY;
-        printf("Vehicle %d stopped at (%d, %d) due to red light\n",
-               vehicle->vehicle_id, vehicle->rect.x, vehicle->rect.y);
+    if (missing > 0) {
+        fprintf(stderr, "This topology can only be used with --sweep\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Looks up the compiled path for the vehicle's movement and places it at the start.
+void assignPath(Vehicle *vehicle) {
+    vehicle->path = findMovementPath(vehicle->road_id, vehicle->lane, vehicle->targetRoad, vehicle->targetLane);
+    vehicle->distance = 0.0f;
+    vehicle->segment = 0;
+    if (!vehicle->path) {
         return;
     }
-    int reachedX = (abs(vehicle->rect.x - targetX) <= vehicle->speed);
-    int reachedY = (abs(vehicle->rect.y - targetY) <= vehicle->speed);
+    vehicle->rect.x = vehicle->path->points[0].x;
+    vehicle->rect.y = vehicle->path->points[0].y;
+}
 
-    // Prioritize movement direction based on road layout
-    if ((vehicle->road_id == 'A' && vehicle->targetRoad == 'C') || 
-        (vehicle->road_id == 'B' && vehicle->targetRoad == 'D')) {
-        // Move Y first
-        if (!reachedY) {
-            vehicle->rect.y += (vehicle->rect.y < targetY) ? vehicle->speed : -vehicle->speed;
-        } else if (!reachedX) {
-            vehicle->rect.x += (vehicle->rect.x < targetX) ? vehicle->speed : -vehicle->speed;
-        }
-    } else {
-        // Move X first
-        if (!reachedX) {
-            vehicle->rect.x += (vehicle->rect.x < targetX) ? vehicle->speed : -vehicle->speed;
-        } else if (!reachedY) {
-            vehicle->rect.y += (vehicle->rect.y < targetY) ? vehicle->speed : -vehicle->speed;
-        }
+int hasArrived(const Vehicle *vehicle) {
+    return vehicle->path && vehicle->distance >= vehicle->path->length;
+}
+
+static int isLightHolding(int lightGroup) {
+    return lightGroup >= 0 && lightGroup != activeLightGroup;
+}
+
+void moveVehicle(Vehicle *vehicle) {
+    const VehiclePath *path = vehicle->path;
+    if (!path || hasArrived(vehicle)) {
+        return;
     }
 
-    // Snap to target position
-    if (reachedX) vehicle->rect.x = targetX;
-    if (reachedY) vehicle->rect.y = targetY;
+    /*Vehicle Stopping Logic */
+    float next = vehicle->distance + vehicle->speed;
+    if (path->stopDistance >= 0 && vehicle->distance <= path->stopDistance && next >= path->stopDistance &&
+        isLightHolding(path->lightGroup)) {
+        next = path->stopDistance;
+    }
+    if (next > path->length) {
+        next = path->length;
+    }
+    vehicle->distance = next;
 
-    if (reachedX && reachedY) {
+    while (vehicle->segment + 2 < path->numPoints && next > path->arcLength[vehicle->segment + 1]) {
+        vehicle->segment++;
+    }
+    const SDL_Point *p0 = &path->points[vehicle->segment];
+    const SDL_Point *p1 = &path->points[vehicle->segment + 1];
+    float segLength = path->arcLength[vehicle->segment + 1] - path->arcLength[vehicle->segment];
+    float t = segLength > 0 ? (next - path->arcLength[vehicle->segment]) / segLength : 1.0f;
+    vehicle->rect.x = p0->x + (int)lroundf(t * (p1->x - p0->x));
+    vehicle->rect.y = p0->y + (int)lroundf(t * (p1->y - p0->y));
+
+    if (hasArrived(vehicle)) {
         vehicle->road_id = vehicle->targetRoad;
         vehicle->lane = vehicle->targetLane;
     }
-    // Debugging Output
-    printf("Vehicle %d Position: (%d, %d) Target: (%d, %d)\n", 
-            vehicle->vehicle_id, vehicle->rect.x, vehicle->rect.y, targetX, targetY);
 }
 
 Uint32 lastSwitchTime = 0;
 
-void updateTrafficLights() {
-    Uint32 currentTime = SDL_GetTicks();
-    if (currentTime - lastSwitchTime > 8555) {
-        udGreen = !udGreen;
-        rlGreen = !rlGreen;
+void updateTrafficLights(Uint32 currentTime) {
+    if (currentTime - lastSwitchTime > lightCycleMs) {
+        activeLightGroup = (activeLightGroup + 1) % topology.numLightGroups;
         lastSwitchTime = currentTime;
-        printf("Traffic Light Changed! North-South: %d, East-West: %d\n", udGreen, rlGreen);
+        printf("Traffic Light Changed! Green: %s\n", topology.lightGroupNames[activeLightGroup]);
     }
 }
 
-void receive_data(int sock) {
-    Vehicle received_data;
-    ssize_t bytes_received = recv(sock, &received_data, sizeof(received_data), MSG_DONTWAIT);
-    if (bytes_received > 0) {
-        Vehicle *v = (Vehicle *)malloc(sizeof(Vehicle));
-        v->vehicle_id = received_data.vehicle_id;
-        v->road_id = received_data.road_id;
-        v->lane = received_data.lane;
-        v->speed = received_data.speed;
+// Arc length of the point of path within 1.5px of (x, y), or -1 if the point isn't on it.
+static float projectOntoPath(const VehiclePath *path, int x, int y, int *segment) {
+    for (int i = 0; i + 1 < path->numPoints; i++) {
+        const SDL_Point *p0 = &path->points[i];
+        const SDL_Point *p1 = &path->points[i + 1];
+        float dx = (float)(p1->x - p0->x), dy = (float)(p1->y - p0->y);
+        float lengthSq = dx * dx + dy * dy;
+        float t = lengthSq > 0 ? ((x - p0->x) * dx + (y - p0->y) * dy) / lengthSq : 0.0f;
+        if (t < 0.0f) t = 0.0f;
+        if (t > 1.0f) t = 1.0f;
+        float ex = p0->x + t * dx - x, ey = p0->y + t * dy - y;
+        if (ex * ex + ey * ey <= 2.25f) {
+            *segment = i;
+            return path->arcLength[i] + t * (path->arcLength[i + 1] - path->arcLength[i]);
+        }
+    }
+    return -1.0f;
+}
+
+// Switches the vehicle to another movement from its entry lane. A vehicle
+// that has started moving can only switch while it is on the part of the
+// road the two paths share, and before the new path's stop line.
+static int rerouteVehicle(Vehicle *v, char targetRoad, int targetLane) {
+    const VehiclePath *path = findMovementPath(v->road_id, v->lane, targetRoad, targetLane);
+    if (!path) {
+        return -1;
+    }
+    float distance = 0.0f;
+    int segment = 0;
+    if (v->distance > 0) {
+        distance = projectOntoPath(path, v->rect.x, v->rect.y, &segment);
+        if (distance < 0 || (path->stopDistance >= 0 && distance > path->stopDistance)) {
+            return -1;
+        }
+    }
+    v->path = path;
+    v->distance = distance;
+    v->segment = segment;
+    v->targetRoad = targetRoad;
+    v->targetLane = targetLane;
+    if (distance == 0) {
+        v->rect.x = path->points[0].x;
+        v->rect.y = path->points[0].y;
+    }
+    return 0;
+}
+
+void handleMessage(const VehicleMessage *msg, VehicleQueue *q, uint64_t receivedNs) {
+    if (msg->type == MSG_ADD_VEHICLE) {
+        // A vehicle added at speed 0 would hold its slot forever; updates may still halt one
+        if (msg->speed < 1 || msg->speed > 100) {
+            printf("Vehicle %d: invalid speed %d, not added\n", msg->vehicle_id, msg->speed);
+            return;
+        }
+        Vehicle *v = (Vehicle *)calloc(1, sizeof(Vehicle));
+        if (!v) {
+            perror("malloc failed");
+            return;
+        }
+        v->vehicle_id = msg->vehicle_id;
+        v->road_id = msg->road_id;
+        v->lane = msg->lane;
+        v->speed = msg->speed;
         v->rect.w = 20;  // Hardcoded as in original
         v->rect.h = 20;  // Hardcoded as in original
-        v->targetRoad = received_data.targetRoad;
-        v->targetLane = received_data.targetLane;
-        getLaneCenter(v->road_id, v->lane, &v->rect.x, &v->rect.y);
-    } else if (bytes_received == 0) {
-        printf("Server disconnected\n");
-    } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
-        perror("Receive failed");
+        v->targetRoad = msg->targetRoad;
+        v->targetLane = msg->targetLane;
+        v->arrivalTime = SDL_GetTicks();
+        if (traceEnabled) {
+            v->trace[TRACE_GENERATED] = msg->generated_ns;
+            v->trace[TRACE_RECEIVED] = receivedNs;
+        }
+        assignPath(v);
+        if (!v->path) {
+            printf("Vehicle %d has no path from %c%d to %c%d, dropped\n", v->vehicle_id,
+                   v->road_id, v->lane, v->targetRoad, v->targetLane);
+            free(v);  // it could never move or leave the road
+            return;
+        }
+        admitVehicle(q, v);
+        return;
+    }
+
+    Vehicle *v = findVehicle(msg->vehicle_id);
+    if (!v) {
+        printf("Update for unknown vehicle %d ignored\n", msg->vehicle_id);
+        return;
+    }
+    switch (msg->type) {
+        case MSG_UPDATE_ROUTE:
+            if (rerouteVehicle(v, msg->targetRoad, msg->targetLane) < 0) {
+                printf("Vehicle %d cannot be rerouted to %c%d\n", v->vehicle_id, msg->targetRoad, msg->targetLane);
+            } else {
+                printf("Vehicle %d rerouted to %c%d\n", v->vehicle_id, msg->targetRoad, msg->targetLane);
+            }
+            break;
+        case MSG_UPDATE_SPEED:
+            if (msg->speed < 0 || msg->speed > 100) {
+                printf("Vehicle %d: invalid speed %d ignored\n", v->vehicle_id, msg->speed);
+            } else {
+                v->speed = msg->speed;
+            }
+            break;
+        case MSG_REMOVE_VEHICLE:
+            unindexVehicle(v->vehicle_id);
+            v->removed = 1;
+            printf("Vehicle %d removed\n", v->vehicle_id);
+            break;
+        default:
+            printf("Unknown message type %d ignored\n", msg->type);
+            break;
+    }
+}
+
+static char receiveBuffer[64 * sizeof(VehicleMessage)];
+static size_t receiveLength = 0;
+
+// Reads everything the generator has sent so far and applies each complete message.
+void receive_data(int sock, VehicleQueue *q) {
+    for (;;) {
+        ssize_t bytes_received = recv(sock, receiveBuffer + receiveLength, sizeof(receiveBuffer) - receiveLength, MSG_DONTWAIT);
+        if (bytes_received > 0) {
+            uint64_t receivedNs = traceEnabled ? monotonicNs() : 0;
+            receiveLength += (size_t)bytes_received;
+            size_t offset = 0;
+            while (receiveLength - offset >= sizeof(VehicleMessage)) {
+                VehicleMessage msg;
+                memcpy(&msg, receiveBuffer + offset, sizeof(msg));
+                handleMessage(&msg, q, receivedNs);
+                offset += sizeof(msg);
+            }
+            memmove(receiveBuffer, receiveBuffer + offset, receiveLength - offset);
+            receiveLength -= offset;
+            continue;
+        }
+        if (bytes_received == 0) {
+            printf("Server disconnected\n");
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("Receive failed");
+        }
+        break;
+    }
+}
+
+
+// Advances the simulation by one frame: admits queued vehicles, switches the
+// lights and moves every active vehicle, removing the ones that have arrived.
+void stepSimulation(VehicleQueue *q, Vehicle **active_vehicles, int *num_active_vehicles, Uint32 now) {
+    while (!isQueueEmpty(q) && *num_active_vehicles < vehicleCapacity) {
+        Vehicle *v = dequeue(q);
+        if (v->removed) {
+            free(v);
+            continue;
+        }
+        v->activateTime = now;
+        traceStamp(v, TRACE_ACTIVATED);
+        Uint32 queueDelay = now - v->arrivalTime;
+        stats.totalQueueDelayMs += queueDelay;
+        if (queueDelay > stats.maxQueueDelayMs) stats.maxQueueDelayMs = queueDelay;
+        active_vehicles[(*num_active_vehicles)++] = v;
+    }
+
+    updateTrafficLights(now);
+
+    for (int i = 0; i < *num_active_vehicles; i++) {
+        Vehicle *v = active_vehicles[i];
+        if (!v) continue;
+        if (v->removed) {
+            free(v);
+            active_vehicles[i] = NULL;
+            continue;
+        }
+        float before = v->distance;
+        moveVehicle(v);
+        if (v->distance == before) {
+            v->stoppedTicks++;
+            traceStamp(v, TRACE_FIRST_STOP);
+        } else if (v->trace[TRACE_FIRST_STOP] != 0) {
+            traceStamp(v, TRACE_RELEASED);
+        }
+        if (hasArrived(v)) {
+            printf("Vehicle %d reached target and is removed.\n", v->vehicle_id);
+            stats.exited++;
+            stats.totalTravelMs += now - v->activateTime;
+            stats.totalStoppedMs += (double)v->stoppedTicks * FRAME_MS;
+            traceVehicleExit(v);
+            unindexVehicle(v->vehicle_id);
+            free(v);
+            active_vehicles[i] = NULL;
+        }
+    }
+    int write_idx = 0;
+    for (int i = 0; i < *num_active_vehicles; i++) {
+        if (active_vehicles[i] != NULL) {
+            active_vehicles[write_idx++] = active_vehicles[i];
+        }
+    }
+    *num_active_vehicles = write_idx;
+}
+
+/* Headless parameter sweep */
+
+#define MAX_SWEEP_VALUES 16
+
+typedef struct {
+    int cycleMs;
+    int arrivalS;   // vehicles arrive every 1..arrivalS seconds, as in the generator
+    int capacity;
+    int speed;
+    unsigned int seed;
+} SweepParams;
+
+typedef struct {
+    SweepParams params;
+    SimStats stats;
+    int stillActive;
+    int ok;
+} SweepResult;
+
+// Picks a road uniformly, then one of its movements by weight. With the
+// built-in topology this is the same distribution as generate_vehicle.
+static Vehicle* spawnVehicle(int speed, Uint32 now) {
+    static int vehicle_counter = 0;
+
+    const Road *road = &topology.roads[topology.spawnRoads[rand() % topology.numSpawnRoads]];
+    int totalWeight = 0;
+    for (int p = 0; p < topology.numPaths; p++) {
+        const VehiclePath *path = &topology.paths[p];
+        if (topology.lanes[path->fromLane].road == road - topology.roads) totalWeight += path->weight;
+    }
+    int pick = rand() % totalWeight;
+    const VehiclePath *chosen = NULL;
+    for (int p = 0; p < topology.numPaths && !chosen; p++) {
+        const VehiclePath *path = &topology.paths[p];
+        if (topology.lanes[path->fromLane].road != road - topology.roads) continue;
+        pick -= path->weight;
+        if (pick < 0) chosen = path;
+    }
+    const Road *target = &topology.roads[topology.lanes[chosen->toLane].road];
+
+    Vehicle *v = (Vehicle *)calloc(1, sizeof(Vehicle));
+    if (!v) {
+        perror("malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    v->vehicle_id = ++vehicle_counter;
+    v->road_id = road->name;
+    v->lane = chosen->fromLane - road->firstLane + 1;
+    v->speed = speed;
+    v->rect.w = 20;
+    v->rect.h = 20;
+    v->targetRoad = target->name;
+    v->targetLane = chosen->toLane - target->firstLane + 1;
+    v->arrivalTime = now;
+    assignPath(v);
+    return v;
+}
+
+// Runs one scenario on simulated time, without SDL, and returns its statistics.
+static SweepResult runHeadless(const SweepParams *p, Uint32 durationMs) {
+    SweepResult result;
+    memset(&result, 0, sizeof(result));
+    result.params = *p;
+
+    srand(p->seed);
+    lightCycleMs = (Uint32)p->cycleMs;
+    vehicleCapacity = p->capacity;
+    memset(&stats, 0, sizeof(stats));
+
+    VehicleQueue q;
+    initQueue(&q);
+    Vehicle *active_vehicles[MAX_VEHICLES] = {0};
+    int num_active_vehicles = 0;
+
+    Uint32 nextArrival = 0;
+    for (Uint32 now = 0; now < durationMs; now += FRAME_MS) {
+        while (now >= nextArrival) {
+            stats.generated++;
+            admitVehicle(&q, spawnVehicle(p->speed, nextArrival));
+            nextArrival += (Uint32)(rand() % p->arrivalS + 1) * 1000;
+        }
+        stepSimulation(&q, active_vehicles, &num_active_vehicles, now);
+    }
+
+    result.stillActive = num_active_vehicles + q.size;
+    for (int i = 0; i < num_active_vehicles; i++) free(active_vehicles[i]);
+    // Vehicles still queued have waited until the end of the run; leaving them
+    // out would understate the delay exactly when the run is saturated
+    while (!isQueueEmpty(&q)) {
+        Vehicle *v = dequeue(&q);
+        Uint32 queueDelay = durationMs - v->arrivalTime;
+        stats.totalQueueDelayMs += queueDelay;
+        if (queueDelay > stats.maxQueueDelayMs) stats.maxQueueDelayMs = queueDelay;
+        free(v);
+    }
+
+    result.stats = stats;
+    result.ok = 1;
+    return result;
+}
+
+static int parseIntList(const char *arg, int *values, int minValue, int maxValue) {
+    int count = 0;
+    const char *cursor = arg;
+    while (*cursor) {
+        char *end;
+        long value = strtol(cursor, &end, 10);
+        if (end == cursor || value < minValue || value > maxValue || count == MAX_SWEEP_VALUES) {
+            fprintf(stderr, "Invalid value list: %s (each value must be %d-%d, at most %d values)\n",
+                    arg, minValue, maxValue, MAX_SWEEP_VALUES);
+            return -1;
+        }
+        values[count++] = (int)value;
+        if (*end == ',') end++;
+        else if (*end != '\0') {
+            fprintf(stderr, "Invalid value list: %s\n", arg);
+            return -1;
+        }
+        cursor = end;
     }
+    return count;
 }
 
+static void writeSweepReport(FILE *out, const SweepResult *results, int count, Uint32 durationMs, int json) {
+    double minutes = durationMs / 60000.0;
+    int written = 0;
+    if (json) fprintf(out, "[\n");
+    else fprintf(out, "cycle_ms,arrival_s,capacity,speed,seed,generated,exited,dropped,still_active,"
+                      "throughput_per_min,mean_queue_delay_ms,max_queue_delay_ms,mean_travel_ms,mean_stopped_ms\n");
+
+    for (int i = 0; i < count; i++) {
+        const SweepResult *r = &results[i];
+        const SimStats *st = &r->stats;
+        int admitted = st->generated - st->dropped;
+        double meanQueueDelay = admitted > 0 ? st->totalQueueDelayMs / admitted : 0.0;
+        double meanTravel = st->exited > 0 ? st->totalTravelMs / st->exited : 0.0;
+        double meanStopped = st->exited > 0 ? st->totalStoppedMs / st->exited : 0.0;
+        if (!r->ok) {
+            fprintf(stderr, "Run %d (seed %u) failed, omitted from report\n", i, r->params.seed);
+            continue;
+        }
+        if (json) {
+            fprintf(out, "%s  {\"cycle_ms\": %d, \"arrival_s\": %d, \"capacity\": %d, \"speed\": %d, \"seed\": %u, "
+                         "\"generated\": %d, \"exited\": %d, \"dropped\": %d, \"still_active\": %d, "
+                         "\"throughput_per_min\": %.3f, \"mean_queue_delay_ms\": %.1f, \"max_queue_delay_ms\": %u, "
+                         "\"mean_travel_ms\": %.1f, \"mean_stopped_ms\": %.1f}",
+                    written > 0 ? ",\n" : "", r->params.cycleMs, r->params.arrivalS, r->params.capacity, r->params.speed, r->params.seed,
+                    st->generated, st->exited, st->dropped, r->stillActive,
+                    st->exited / minutes, meanQueueDelay, st->maxQueueDelayMs, meanTravel, meanStopped);
+        } else {
+            fprintf(out, "%d,%d,%d,%d,%u,%d,%d,%d,%d,%.3f,%.1f,%u,%.1f,%.1f\n",
+                    r->params.cycleMs, r->params.arrivalS, r->params.capacity, r->params.speed, r->params.seed,
+                    st->generated, st->exited, st->dropped, r->stillActive,
+                    st->exited / minutes, meanQueueDelay, st->maxQueueDelayMs, meanTravel, meanStopped);
+        }
+        written++;
+    }
+    if (json) fprintf(out, "%s]\n", written > 0 ? "\n" : "");
+}
+
+static void printSweepUsage(void) {
+    fprintf(stderr,
+            "Usage: Simulator --sweep [options]\n"
+            "  --cycle LIST      light cycle lengths in ms (default 8555)\n"
+            "  --arrival LIST    max seconds between arrivals (default 3)\n"
+            "  --capacity LIST   vehicle capacity, at most %d (default %d)\n"
+            "  --speed LIST      vehicle speed in pixels per frame (default 2)\n"
+            "  --seeds N         runs per parameter combination (default 1)\n"
+            "  --seed S          first seed of every combination (default 1)\n"
+            "  --duration MS     simulated time per run (default 600000)\n"
+            "  --jobs N          concurrent worker processes (default: online CPUs)\n"
+            "  --out FILE        report path, .json for JSON, otherwise CSV (default stdout)\n"
+            "  --topology FILE   intersection layout (default: built-in four-way)\n"
+            "LIST is a comma separated list, e.g. --cycle 4000,8555,12000\n",
+            MAX_VEHICLES, MAX_VEHICLES);
+}
+
+// Stops the workers still running after a failure so none outlive the sweep.
+static void killWorkers(pid_t *workers, int *pipes, int count) {
+    for (int i = 0; i < count; i++) {
+        if (workers[i] > 0) kill(workers[i], SIGTERM);
+    }
+    for (int i = 0; i < count; i++) {
+        if (workers[i] > 0) {
+            waitpid(workers[i], NULL, 0);
+            close(pipes[i]);
+            workers[i] = 0;
+        }
+    }
+}
+
+// Runs every combination of the given parameter lists in forked worker
+// processes, each on its own seed, and writes one aggregated report.
+int runSweep(int argc, char *argv[]) {
+    int cycles[MAX_SWEEP_VALUES] = {8555}, numCycles = 1;
+    int arrivals[MAX_SWEEP_VALUES] = {3}, numArrivals = 1;
+    int capacities[MAX_SWEEP_VALUES] = {MAX_VEHICLES}, numCapacities = 1;
+    int speeds[MAX_SWEEP_VALUES] = {2}, numSpeeds = 1;
+    int seedsPerPoint = 1;
+    unsigned int baseSeed = 1;
+    Uint32 durationMs = 600000;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int jobs = cpus > 0 ? (int)cpus : 1;
+    const char *outPath = NULL;
+    const char *topologyPath = NULL;
+
+    for (int i = 1; i < argc; i += 2) {
+        const char *opt = argv[i];
+        const char *val = (i + 1 < argc) ? argv[i + 1] : NULL;
+        int valid = val != NULL;
+        if (!valid) {
+            // Missing value
+        } else if (strcmp(opt, "--cycle") == 0) {
+            valid = (numCycles = parseIntList(val, cycles, 1, 3600000)) > 0;
+        } else if (strcmp(opt, "--arrival") == 0) {
+            valid = (numArrivals = parseIntList(val, arrivals, 1, 3600)) > 0;
+        } else if (strcmp(opt, "--capacity") == 0) {
+            valid = (numCapacities = parseIntList(val, capacities, 1, MAX_VEHICLES)) > 0;
+        } else if (strcmp(opt, "--speed") == 0) {
+            valid = (numSpeeds = parseIntList(val, speeds, 1, 100)) > 0;
+        } else if (strcmp(opt, "--seeds") == 0) {
+            valid = (seedsPerPoint = atoi(val)) > 0;
+        } else if (strcmp(opt, "--seed") == 0) {
+            baseSeed = (unsigned int)strtoul(val, NULL, 10);
+        } else if (strcmp(opt, "--duration") == 0) {
+            valid = (durationMs = (Uint32)strtoul(val, NULL, 10)) > 0;
+        } else if (strcmp(opt, "--jobs") == 0) {
+            valid = (jobs = atoi(val)) > 0;
+        } else if (strcmp(opt, "--out") == 0) {
+            outPath = val;
+        } else if (strcmp(opt, "--topology") == 0) {
+            topologyPath = val;
+        } else {
+            valid = 0;
+        }
+        if (!valid) {
+            printSweepUsage();
+            return 1;
+        }
+    }
+
+    // Loaded once here; every worker inherits the compiled tables
+    if (loadTopology(topologyPath) < 0) {
+        return 1;
+    }
+    if (topology.numSpawnRoads == 0) {
+        fprintf(stderr, "Topology has no movement with a spawn weight\n");
+        return 1;
+    }
+
+    int total = numCycles * numArrivals * numCapacities * numSpeeds * seedsPerPoint;
+    SweepResult *results = (SweepResult *)calloc((size_t)total, sizeof(SweepResult));
+    pid_t *workers = (pid_t *)calloc((size_t)total, sizeof(pid_t));
+    int *pipes = (int *)calloc((size_t)total, sizeof(int));
+    if (!results || !workers || !pipes) {
+        perror("malloc failed");
+        return 1;
+    }
+
+    // Every combination runs the same seeds, so rows differ only by their parameters
+    int run = 0;
+    for (int c = 0; c < numCycles; c++)
+        for (int a = 0; a < numArrivals; a++)
+            for (int k = 0; k < numCapacities; k++)
+                for (int sp = 0; sp < numSpeeds; sp++)
+                    for (int sd = 0; sd < seedsPerPoint; sd++, run++) {
+                        results[run].params = (SweepParams){cycles[c], arrivals[a], capacities[k], speeds[sp],
+                                                            baseSeed + (unsigned int)sd};
+                    }
+
+    fprintf(stderr, "Sweeping %d runs on %d workers\n", total, jobs);
+    fflush(stdout);  // don't let the workers inherit buffered output
+    int next = 0, running = 0, done = 0;
+    while (done < total) {
+        while (running < jobs && next < total) {
+            int fds[2];
+            if (pipe(fds) < 0) {
+                perror("pipe failed");
+                killWorkers(workers, pipes, next);
+                return 1;
+            }
+            pid_t pid = fork();
+            if (pid < 0) {
+                perror("fork failed");
+                close(fds[0]);
+                close(fds[1]);
+                killWorkers(workers, pipes, next);
+                return 1;
+            }
+            if (pid == 0) {
+                close(fds[0]);
+                // Keep the per-vehicle logging out of the report
+                if (!freopen("/dev/null", "w", stdout)) _exit(EXIT_FAILURE);
+                SweepResult r = runHeadless(&results[next].params, durationMs);
+                ssize_t written = write(fds[1], &r, sizeof(r));
+                _exit(written == (ssize_t)sizeof(r) ? EXIT_SUCCESS : EXIT_FAILURE);
+            }
+            close(fds[1]);
+            workers[next] = pid;
+            pipes[next] = fds[0];
+            next++;
+            running++;
+        }
+
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0) {
+            perror("wait failed");
+            killWorkers(workers, pipes, next);
+            return 1;
+        }
+        for (int i = 0; i < next; i++) {
+            if (workers[i] != pid) continue;
+            SweepResult r;
+            if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS &&
+                read(pipes[i], &r, sizeof(r)) == (ssize_t)sizeof(r)) {
+                results[i] = r;
+            }
+            close(pipes[i]);
+            workers[i] = 0;
+            running--;
+            done++;
+            break;
+        }
+    }
+
+    FILE *out = stdout;
+    if (outPath) {
+        out = fopen(outPath, "w");
+        if (!out) {
+            perror("Cannot open report");
+            return 1;
+        }
+    }
+    size_t pathLen = outPath ? strlen(outPath) : 0;
+    int json = pathLen >= 5 && strcmp(outPath + pathLen - 5, ".json") == 0;
+    writeSweepReport(out, results, total, durationMs, json);
+    int failed = 0;
+    for (int i = 0; i < total; i++) {
+        if (!results[i].ok) failed++;
+    }
+    if (out != stdout) {
+        fclose(out);
+        fprintf(stderr, "Wrote %d runs to %s\n", total - failed, outPath);
+    }
+    if (failed > 0) {
+        fprintf(stderr, "%d of %d runs failed\n", failed, total);
+    }
+
+    free(results);
+    free(workers);
+    free(pipes);
+    return failed > 0 ? 1 : 0;
+}
+
+static void printUsage(void) {
+    fprintf(stderr,
+            "Usage: Simulator [options]\n"
+            "       Simulator --sweep [options]\n"
+            "  --topology FILE        intersection layout (default: built-in four-way)\n"
+            "  --offscreen            render into a software surface instead of a window\n"
+            "  --frames N             stop after N frames (default: run until closed)\n"
+            "  --record DIR           write rendered frames into DIR\n"
+            "  --record-every N       keep every Nth frame (default 1)\n"
+            "  --record-format FMT    bmp or raw (binary PPM) (default bmp)\n"
+            "  --trace FILE           append per-stage latency histograms to FILE\n"
+            "  --trace-interval S     seconds between histogram dumps (default 10)\n");
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1 && strcmp(argv[1], "--sweep") == 0) {
+        return runSweep(argc - 1, argv + 1);
+    }
+
+    const char *topologyPath = NULL;
+    int offscreen = 0;
+    int maxFrames = 0;
+    const char *recordDir = NULL;
+    int recordEvery = 1;
+    RecordFormat recordFormat = RECORD_BMP;
+    const char *tracePath = NULL;
+    int traceInterval = 10;
+    for (int i = 1; i < argc; i++) {
+        const char *val = (i + 1 < argc) ? argv[i + 1] : NULL;
+        int valid = 1;
+        if (strcmp(argv[i], "--offscreen") == 0) {
+            offscreen = 1;
+            continue;
+        } else if (!val) {
+            valid = 0;
+        } else if (strcmp(argv[i], "--topology") == 0) {
+            topologyPath = val;
+        } else if (strcmp(argv[i], "--frames") == 0) {
+            valid = (maxFrames = atoi(val)) > 0;
+        } else if (strcmp(argv[i], "--record") == 0) {
+            recordDir = val;
+        } else if (strcmp(argv[i], "--record-every") == 0) {
+            valid = (recordEvery = atoi(val)) > 0;
+        } else if (strcmp(argv[i], "--trace") == 0) {
+            tracePath = val;
+        } else if (strcmp(argv[i], "--trace-interval") == 0) {
+            valid = (traceInterval = atoi(val)) > 0;
+        } else if (strcmp(argv[i], "--record-format") == 0) {
+            if (strcmp(val, "bmp") == 0) recordFormat = RECORD_BMP;
+            else if (strcmp(val, "raw") == 0) recordFormat = RECORD_RAW;
+            else valid = 0;
+        } else {
+            valid = 0;
+        }
+        if (!valid) {
+            printUsage();
+            return 1;
+        }
+        i++;
+    }
+
+    if (loadTopology(topologyPath) < 0 || checkGeneratorMovements(topologyPath ? topologyPath : "built-in") < 0) {
+        return 1;
+    }
 
-int main() {
     // Socket related code commented out during the development of UI elements
      int sock = create_socket();
 
-    if (InitializeSDL() < 0) {
-        return 1;
+    SDL_Surface *offscreenSurface = NULL;
+    if (offscreen) {
+        // No video subsystem needed; events still deliver SDL_QUIT on SIGINT
+        if (InitializeSDL(SDL_INIT_EVENTS) < 0) {
+            return 1;
+        }
+        renderer = CreateOffscreenRenderer(SCREEN_WIDTH, SCREEN_HEIGHT, &offscreenSurface);
+        if (!renderer) {
+            return 1;
+        }
+    } else {
+        if (InitializeSDL(SDL_INIT_VIDEO) < 0) {
+            return 1;
+        }
+        window = CreateWindow("Traffic Simulator", SCREEN_WIDTH, SCREEN_HEIGHT);
+        if (!window) {   
+            return 1;
+        }
+        renderer = CreateRenderer(window);
+        if (!renderer) {
+            return 1;
+        }
     }
-    window = CreateWindow("Traffic Simulator", SCREEN_WIDTH, SCREEN_HEIGHT);
-    if (!window) {   
+
+    FrameRecorder recorder = {0};
+    if (recordDir && startRecorder(&recorder, recordDir, recordFormat, SCREEN_WIDTH, SCREEN_HEIGHT) < 0) {
         return 1;
     }
-    renderer = CreateRenderer(window);
-    if (!renderer) {
+    TraceReporter traceReporter = {0};
+    if (tracePath && startTraceReporter(&traceReporter, tracePath, (Uint32)traceInterval * 1000) < 0) {
         return 1;
     }
     VehicleQueue queue;
@@ -595,6 +1980,7 @@ int main() {
     Vehicle *active_vehicles[MAX_VEHICLES] = {0};
     int num_active_vehicles = 0;
     int running = 1;
+    int frame = 0;
     SDL_Event event;
     while (running) {
         while (SDL_PollEvent(&event)) {
@@ -603,38 +1989,13 @@ int main() {
             }
         }
 
-        receive_data(sock);
-
-        while (!isQueueEmpty(&queue) && num_active_vehicles < MAX_VEHICLES) {
-            Vehicle *v = dequeue(&queue);
-            active_vehicles[num_active_vehicles++] = v;
-        }
+        receive_data(sock, &queue);
 
-        updateTrafficLights();
+        stepSimulation(&queue, active_vehicles, &num_active_vehicles, SDL_GetTicks());
 
-for (int i = 0; i < num_active_vehicles; i++) {
-            if (active_vehicles[i]) {
-                moveVehicle(active_vehicles[i]);
-                int targetX, targetY;
-                getLaneCenter(active_vehicles[i]->targetRoad, active_vehicles[i]->targetLane, &targetX, &targetY);
-                if (abs(active_vehicles[i]->rect.x - targetX) <= active_vehicles[i]->speed && 
-                    abs(active_vehicles[i]->rect.y - targetY) <= active_vehicles[i]->speed) {
-                    printf("Vehicle %d reached target and is removed.\n", active_vehicles[i]->vehicle_id);
-                    free(active_vehicles[i]);
-                    active_vehicles[i] = NULL;
-                }
-            }
-        }
-        int write_idx = 0;
-        for (int i = 0; i < num_active_vehicles; i++) {
-            if (active_vehicles[i] != NULL) {
-                active_vehicles[write_idx++] = active_vehicles[i];
-            }
-        }
-        num_active_vehicles = write_idx;
         DrawBackground(renderer);
 
-        TrafficLightState(renderer, udGreen, rlGreen);
+        TrafficLightState(renderer);
 
 
 
@@ -645,11 +2006,26 @@ for (int i = 0; i < num_active_vehicles; i++) {
                 drawVehicle(renderer, active_vehicles[i]);
             }
         }
+        // Read back before presenting; the back buffer is undefined afterwards
+        if (recordDir && frame % recordEvery == 0) {
+            captureFrame(&recorder, renderer, frame);
+        }
         SDL_RenderPresent(renderer);
-        SDL_Delay(30);
+        frame++;
+        if (maxFrames > 0 && frame >= maxFrames) {
+            running = 0;
+        }
+        SDL_Delay(FRAME_MS);
 
     }
 
+    if (recordDir) {
+        stopRecorder(&recorder);
+    }
+    if (tracePath) {
+        stopTraceReporter(&traceReporter);
+    }
+
 
     for (int i = 0; i < num_active_vehicles; i++) {
         if (active_vehicles[i]) free(active_vehicles[i]);
@@ -660,7 +2036,8 @@ for (int i = 0; i < num_active_vehicles; i++) {
      close(sock);
 
     SDL_DestroyRenderer(renderer);
-    SDL_DestroyWindow(window);
+    if (window) SDL_DestroyWindow(window);
+    if (offscreenSurface) SDL_FreeSurface(offscreenSurface);
     SDL_Quit();
 
     return 0;